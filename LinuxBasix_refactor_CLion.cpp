@@ -36,6 +36,19 @@
 #include <sys/wait.h>
 #include <fstream>
 #include <sys/utsname.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <iomanip>
+#include <sstream>
+#include <filesystem>
+#include <map>
+#include <deque>
+#include <memory>
+#include <cerrno>
+#include <fcntl.h>
 
 using namespace std;
 
@@ -45,6 +58,9 @@ struct Configuration
     vector<string> main_menu_options;
     vector<string> programs_to_install;
     vector<string> flatpak_programs_to_install;
+    vector<string> target_roots; // chroot/nspawn root directories, empty = install on this machine
+    string shared_cache_dir;     // .deb archive cache shared by all target roots
+    bool use_nspawn;             // enter target roots with systemd-nspawn instead of chroot
 };
 
 // Abstract classes for better testability
@@ -53,6 +69,8 @@ class SystemInfo
 public:
     virtual string getKernelVersion() = 0;
     virtual vector<string> checkPackageManagers() = 0;
+    // App IDs deployed for the native arch in any system or user flatpak installation
+    virtual set<string> getDeployedFlatpakApps() = 0;
     virtual ~SystemInfo() = default;
 };
 
@@ -66,10 +84,85 @@ public:
 class CommandExecutor
 {
 public:
-    virtual void execute(const vector<string>& command) = 0;
+    // Returns the exit status of the command (-1 if it could not be started).
+    // Must be thread-safe: MultiTargetProvisioner calls it from one thread per target root at the same time.
+    virtual int execute(const vector<string>& command) = 0;
     virtual ~CommandExecutor() = default;
 };
 
+// Deployed flatpak app ref (app/<app_id>/<arch>/<branch>)
+struct FlatpakRef
+{
+    string app_id;
+    string arch;
+    string branch;
+    string installation;
+};
+
+// Reads deployed app refs straight from flatpak installation directories instead of spawning
+// `flatpak list`. A ref counts as deployed when <installation>/app/<app_id>/<arch>/<branch>/active exists.
+class FlatpakInstallationReader
+{
+    vector<string> installation_dirs;
+
+public:
+    explicit FlatpakInstallationReader(vector<string> dirs) : installation_dirs(move(dirs))
+    {
+    }
+
+    vector<FlatpakRef> readDeployedApps() const
+    {
+        vector<FlatpakRef> refs;
+        error_code ec;
+
+        for (const auto& installation : installation_dirs)
+        {
+            for (const auto& app : listDirectory(filesystem::path(installation) / "app"))
+            {
+                if (!app.is_directory(ec)) continue;
+                for (const auto& arch : listDirectory(app.path()))
+                {
+                    // "current" is a symlink to the default <arch>/<branch>, not an arch of its own
+                    if (arch.is_symlink(ec) || !arch.is_directory(ec)) continue;
+                    for (const auto& branch : listDirectory(arch.path()))
+                    {
+                        if (filesystem::exists(branch.path() / "active", ec))
+                        {
+                            refs.push_back({
+                                app.path().filename().string(), arch.path().filename().string(),
+                                branch.path().filename().string(), installation
+                            });
+                        }
+                    }
+                }
+            }
+        }
+        return refs;
+    }
+
+    // Maps a uname() machine name to the arch name flatpak uses in its refs
+    static string flatpakArch(const string& machine)
+    {
+        if (machine.size() == 4 && machine[0] == 'i' && machine.substr(2) == "86") return "i386";
+        if (machine.rfind("arm", 0) == 0) return "arm";
+        return machine;
+    }
+
+private:
+    // Entries of dir, stopping quietly at the first error (unreadable or vanishing directory) instead of
+    // throwing filesystem_error out of the menu like the range-for increment would
+    static vector<filesystem::directory_entry> listDirectory(const filesystem::path& dir)
+    {
+        vector<filesystem::directory_entry> entries;
+        error_code ec;
+        for (filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+        {
+            entries.push_back(*it);
+        }
+        return entries;
+    }
+};
+
 // Concrete implementations
 class RealSystemInfo final : public SystemInfo
 {
@@ -99,6 +192,44 @@ public:
         return availablePackageManagers;
     }
 
+    set<string> getDeployedFlatpakApps() override
+    {
+        utsname buffer{};
+        const string arch = uname(&buffer) == 0 ? FlatpakInstallationReader::flatpakArch(buffer.machine) : "";
+
+        set<string> apps;
+        for (const auto& ref : FlatpakInstallationReader(flatpakInstallationDirs()).readDeployedApps())
+        {
+            if (arch.empty() || ref.arch == arch)
+            {
+                apps.insert(ref.app_id);
+            }
+        }
+        return apps;
+    }
+
+    // System and user installations, honouring the same overrides as flatpak itself
+    static vector<string> flatpakInstallationDirs()
+    {
+        vector<string> dirs;
+        const char* system_dir = getenv("FLATPAK_SYSTEM_DIR");
+        dirs.emplace_back(system_dir ? system_dir : "/var/lib/flatpak");
+
+        if (const char* user_dir = getenv("FLATPAK_USER_DIR"))
+        {
+            dirs.emplace_back(user_dir);
+        }
+        else if (const char* data_home = getenv("XDG_DATA_HOME"))
+        {
+            dirs.push_back(string(data_home) + "/flatpak");
+        }
+        else if (const char* home = getenv("HOME"))
+        {
+            dirs.push_back(string(home) + "/.local/share/flatpak");
+        }
+        return dirs;
+    }
+
 private:
     bool static commandExists(const string& command)
     {
@@ -126,19 +257,40 @@ public:
     }
 };
 
+// Null-terminated argv for execvp(), pointing into command
+vector<char*> make_exec_args(const vector<string>& command)
+{
+    vector<char*> args;
+    args.reserve(command.size() + 1);
+
+    for (const auto& arg : command)
+    {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+    return args;
+}
+
+// Turns a waitpid() status into the exit status returned by CommandExecutor::execute
+int decode_wait_status(const vector<string>& command, const int status)
+{
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+    {
+        cerr << "Command " << command[0] << " failed with return code " << WEXITSTATUS(status) << "\n";
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
 class RealCommandExecutor final : public CommandExecutor
 {
 public:
-    void execute(const vector<string>& command) override
+    int execute(const vector<string>& command) override
     {
-        vector<char*> args;
-        args.reserve(command.size());
-
-        for (const auto& arg : command)
-        {
-            args.push_back(const_cast<char*>(arg.c_str()));
-        }
-        args.push_back(nullptr);
+        vector<char*> args = make_exec_args(command);
 
         if (const pid_t pid = fork(); pid == 0)
         {
@@ -149,31 +301,789 @@ public:
         else if (pid < 0)
         {
             perror("fork");
+            return -1;
         }
         else
         {
             int status;
             waitpid(pid, &status, 0);
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+            return decode_wait_status(command, status);
+        }
+    }
+};
+
+string join(const vector<string>& vec, const string& delimiter)
+{
+    string result;
+    if (vec.empty()) result = "None";
+
+    for (size_t i = 0; i < vec.size(); ++i)
+    {
+        if (i > 0) result += delimiter;
+        result += vec[i];
+    }
+    return result;
+}
+
+// Output written by a traced command, offset measured from the start of that command
+struct CommandTraceChunk
+{
+    chrono::microseconds offset;
+    string data;
+};
+
+// One executed command of a record/replay trace
+struct CommandTraceRecord
+{
+    vector<string> argv;
+    chrono::microseconds start; // relative to the start of the traced run
+    chrono::microseconds duration;
+    int exit_status;
+    vector<CommandTraceChunk> output;
+};
+
+// A SystemInfo answer of a traced run, valid from the point where after_commands commands had finished
+struct SystemInfoAnswer
+{
+    size_t after_commands;
+    vector<string> values;
+};
+
+// Contents of a trace file: the executed commands plus every change of the SystemInfo answers the run was
+// based on (query name -> answers in recorded order), so a replay takes the same decisions on any machine
+struct CommandTrace
+{
+    vector<CommandTraceRecord> commands;
+    map<string, vector<SystemInfoAnswer>> system_info;
+};
+
+// Trace fields are stored one per line, so line breaks, tabs and backslashes are escaped
+string escape_trace_field(const string& field)
+{
+    string escaped;
+    escaped.reserve(field.size());
+    for (const char c : field)
+    {
+        switch (c)
+        {
+        case '\\': escaped += "\\\\";
+            break;
+        case '\n': escaped += "\\n";
+            break;
+        case '\r': escaped += "\\r";
+            break;
+        case '\t': escaped += "\\t";
+            break;
+        default: escaped += c;
+            break;
+        }
+    }
+    return escaped;
+}
+
+string unescape_trace_field(const string& field)
+{
+    string unescaped;
+    unescaped.reserve(field.size());
+    for (size_t i = 0; i < field.size(); ++i)
+    {
+        if (field[i] != '\\' || i + 1 == field.size())
+        {
+            unescaped += field[i];
+            continue;
+        }
+        switch (field[++i])
+        {
+        case 'n': unescaped += '\n';
+            break;
+        case 'r': unescaped += '\r';
+            break;
+        case 't': unescaped += '\t';
+            break;
+        default: unescaped += field[i];
+            break;
+        }
+    }
+    return unescaped;
+}
+
+// Appends command records to a trace file. Shared by concurrently provisioned targets, hence the lock.
+//
+// Format, one record per command in completion order, interleaved with SystemInfo answers:
+//   LinuxBasix-trace 1
+//   command <start_us> <duration_us> <exit_status>
+//   arg <escaped argv element>            (one line per element)
+//   out <offset_us> <escaped output>      (one line per chunk read from the command)
+//   sysinfo <query> <commands finished before the answer changed>
+//   value <escaped element of the answer> (one line per element)
+class CommandTraceWriter
+{
+    ofstream file;
+    mutex file_mutex;
+    size_t commands_appended = 0;
+    const chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+
+public:
+    explicit CommandTraceWriter(const string& path) : file(path, ios_base::trunc)
+    {
+        if (file.is_open())
+        {
+            file << "LinuxBasix-trace 1\n";
+        }
+    }
+
+    bool is_open() const
+    {
+        return file.is_open();
+    }
+
+    chrono::microseconds since_start(const chrono::steady_clock::time_point time) const
+    {
+        return chrono::duration_cast<chrono::microseconds>(time - origin);
+    }
+
+    void append(const CommandTraceRecord& record)
+    {
+        const lock_guard lock(file_mutex);
+        file << "command " << record.start.count() << " " << record.duration.count() << " " << record.exit_status
+            << "\n";
+        for (const auto& arg : record.argv)
+        {
+            file << "arg " << escape_trace_field(arg) << "\n";
+        }
+        for (const auto& chunk : record.output)
+        {
+            file << "out " << chunk.offset.count() << " " << escape_trace_field(chunk.data) << "\n";
+        }
+        file.flush(); // keep the trace usable if the run is interrupted
+        ++commands_appended;
+    }
+
+    void append_system_info(const string& query, const vector<string>& values)
+    {
+        const lock_guard lock(file_mutex);
+        file << "sysinfo " << query << " " << commands_appended << "\n";
+        for (const auto& value : values)
+        {
+            file << "value " << escape_trace_field(value) << "\n";
+        }
+        file.flush();
+    }
+};
+
+bool read_command_trace(const string& path, CommandTrace& trace)
+{
+    vector<CommandTraceRecord>& records = trace.commands;
+    vector<string>* system_info_values = nullptr; // answer the "value" lines belong to
+    ifstream file(path);
+    string line;
+    if (!file.is_open() || !getline(file, line) || line != "LinuxBasix-trace 1")
+    {
+        return false;
+    }
+
+    while (getline(file, line))
+    {
+        if (line.rfind("command ", 0) == 0)
+        {
+            istringstream fields(line.substr(8));
+            long long start, duration;
+            int exit_status;
+            if (!(fields >> start >> duration >> exit_status))
+            {
+                return false;
+            }
+            records.push_back({{}, chrono::microseconds(start), chrono::microseconds(duration), exit_status, {}});
+            system_info_values = nullptr;
+        }
+        else if (line.rfind("sysinfo ", 0) == 0)
+        {
+            istringstream fields(line.substr(8));
+            string query;
+            size_t after_commands;
+            if (!(fields >> query >> after_commands))
+            {
+                return false;
+            }
+            auto& answers = trace.system_info[query];
+            answers.push_back({after_commands, {}});
+            system_info_values = &answers.back().values;
+        }
+        else if (line.rfind("value ", 0) == 0 && system_info_values)
+        {
+            system_info_values->push_back(unescape_trace_field(line.substr(6)));
+        }
+        else if (line.rfind("arg ", 0) == 0 && !records.empty() && !system_info_values)
+        {
+            records.back().argv.push_back(unescape_trace_field(line.substr(4)));
+        }
+        else if (line.rfind("out ", 0) == 0 && !records.empty() && !system_info_values)
+        {
+            const size_t separator = line.find(' ', 4);
+            if (separator == string::npos)
             {
-                cerr << "Command " << command[0] << " failed with return code " << WEXITSTATUS(status) << "\n";
+                return false;
             }
+            records.back().output.push_back({
+                chrono::microseconds(atoll(line.substr(4, separator - 4).c_str())),
+                unescape_trace_field(line.substr(separator + 1))
+            });
         }
+        else if (!line.empty())
+        {
+            return false;
+        }
+    }
+    return all_of(records.begin(), records.end(), [](const CommandTraceRecord& r) { return !r.argv.empty(); });
+}
+
+// Runs commands like RealCommandExecutor, but tees their stdout/stderr through a pipe so that argv, output,
+// exit status and timing of every command end up in a trace that ReplayCommandExecutor can play back
+class RecordingCommandExecutor final : public CommandExecutor
+{
+    CommandTraceWriter& trace;
+
+public:
+    explicit RecordingCommandExecutor(CommandTraceWriter& writer) : trace(writer)
+    {
+    }
+
+    int execute(const vector<string>& command) override
+    {
+        vector<char*> args = make_exec_args(command);
+        const auto start = chrono::steady_clock::now();
+        CommandTraceRecord record{command, trace.since_start(start), {}, -1, {}};
+
+        // O_CLOEXEC keeps the write end out of commands forked concurrently by other threads, which would
+        // otherwise hold the pipe open and delay EOF until they exit
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+        {
+            perror("pipe2");
+            return -1;
+        }
+
+        const pid_t pid = fork();
+        if (pid == 0)
+        {
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            dup2(pipe_fds[1], STDERR_FILENO);
+            execvp(args[0], args.data());
+            perror("execvp");
+            exit(EXIT_FAILURE);
+        }
+        close(pipe_fds[1]);
+        if (pid < 0)
+        {
+            perror("fork");
+            close(pipe_fds[0]);
+            return -1;
+        }
+
+        char buffer[4096];
+        ssize_t length;
+        while ((length = read(pipe_fds[0], buffer, sizeof(buffer))) != 0)
+        {
+            if (length < 0)
+            {
+                if (errno == EINTR) continue;
+                break;
+            }
+            record.output.push_back({
+                chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start),
+                string(buffer, length)
+            });
+            cout.write(buffer, length).flush();
+        }
+        close(pipe_fds[0]);
+
+        int status;
+        waitpid(pid, &status, 0);
+        record.exit_status = decode_wait_status(command, status);
+        record.duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+        trace.append(record);
+        return record.exit_status;
+    }
+};
+
+// Plays back a recorded trace instead of running anything: each command gets the output, exit status and
+// timing of its recorded counterpart (same argv, in recorded order), with all delays multiplied by
+// time_scale (1 = exact, 0 = no delays). Optionally traces the replayed run for compare_command_traces().
+class ReplayCommandExecutor final : public CommandExecutor
+{
+    map<vector<string>, deque<CommandTraceRecord>> recorded;
+    mutex recorded_mutex;
+    double time_scale;
+    CommandTraceWriter* trace;
+    atomic<size_t> replayed_commands{0};
+
+public:
+    ReplayCommandExecutor(const vector<CommandTraceRecord>& records, const double scale,
+                          CommandTraceWriter* writer = nullptr)
+        : time_scale(scale), trace(writer)
+    {
+        for (const auto& record : records)
+        {
+            recorded[record.argv].push_back(record);
+        }
+    }
+
+    int execute(const vector<string>& command) override
+    {
+        const auto start = chrono::steady_clock::now();
+        CommandTraceRecord replayed{command, {}, {}, -1, {}};
+
+        CommandTraceRecord original;
+        bool found = false;
+        {
+            const lock_guard lock(recorded_mutex);
+            if (const auto it = recorded.find(command); it != recorded.end() && !it->second.empty())
+            {
+                original = move(it->second.front());
+                it->second.pop_front();
+                found = true;
+            }
+        }
+
+        if (found)
+        {
+            for (const auto& chunk : original.output)
+            {
+                this_thread::sleep_until(start + scaled(chunk.offset));
+                cout.write(chunk.data.data(), static_cast<streamsize>(chunk.data.size())).flush();
+                replayed.output.push_back({
+                    chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start), chunk.data
+                });
+            }
+            this_thread::sleep_until(start + scaled(original.duration));
+            replayed.exit_status = original.exit_status;
+        }
+        else
+        {
+            cerr << "No recorded run left for command: " << join(command, " ") << "\n";
+        }
+
+        if (trace)
+        {
+            replayed.start = trace->since_start(start);
+            replayed.duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+            trace->append(replayed);
+        }
+        ++replayed_commands;
+        return replayed.exit_status;
+    }
+
+    // Commands finished so far, the point of the recorded run ReplaySystemInfo answers for
+    size_t commands_replayed() const
+    {
+        return replayed_commands;
+    }
+
+private:
+    chrono::steady_clock::duration scaled(const chrono::microseconds duration) const
+    {
+        return chrono::duration_cast<chrono::steady_clock::duration>(duration * time_scale);
+    }
+};
+
+// Passes SystemInfo queries through and adds their answers to the trace, since the install commands are
+// built from them (e.g. deployed Flatpaks are left out of option 5). Only changed answers are written, so
+// menu redraws do not add a record per keypress.
+class RecordingSystemInfo final : public SystemInfo
+{
+    SystemInfo& systemInfo;
+    CommandTraceWriter& trace;
+    map<string, vector<string>> last_recorded;
+    mutex recorded_mutex;
+
+public:
+    RecordingSystemInfo(SystemInfo& si, CommandTraceWriter& writer) : systemInfo(si), trace(writer)
+    {
+    }
+
+    string getKernelVersion() override
+    {
+        string version = systemInfo.getKernelVersion();
+        record("kernel_version", {version});
+        return version;
+    }
+
+    vector<string> checkPackageManagers() override
+    {
+        vector<string> managers = systemInfo.checkPackageManagers();
+        record("package_managers", managers);
+        return managers;
+    }
+
+    set<string> getDeployedFlatpakApps() override
+    {
+        set<string> apps = systemInfo.getDeployedFlatpakApps();
+        record("deployed_flatpak_apps", vector<string>(apps.begin(), apps.end()));
+        return apps;
+    }
+
+private:
+    void record(const string& query, const vector<string>& values)
+    {
+        const lock_guard lock(recorded_mutex);
+        if (const auto it = last_recorded.find(query); it != last_recorded.end() && it->second == values)
+        {
+            return;
+        }
+        last_recorded[query] = values;
+        trace.append_system_info(query, values);
+    }
+};
+
+// Answers SystemInfo queries from a trace instead of looking at this machine: each query gets the answer that
+// was current in the recorded run after as many commands as the replay has finished so far. Keying on
+// command progress instead of call order keeps answers right when the replay redraws the menu or opens the
+// pickers a different number of times.
+class ReplaySystemInfo final : public SystemInfo
+{
+    map<string, vector<SystemInfoAnswer>> answers;
+    const ReplayCommandExecutor& replay;
+
+public:
+    ReplaySystemInfo(map<string, vector<SystemInfoAnswer>> recorded, const ReplayCommandExecutor& executor)
+        : answers(move(recorded)), replay(executor)
+    {
+    }
+
+    string getKernelVersion() override
+    {
+        const vector<string> version = answer("kernel_version");
+        return version.empty() ? "Unknown" : version.front();
+    }
+
+    vector<string> checkPackageManagers() override
+    {
+        return answer("package_managers");
+    }
+
+    set<string> getDeployedFlatpakApps() override
+    {
+        const vector<string> apps = answer("deployed_flatpak_apps");
+        return {apps.begin(), apps.end()};
+    }
+
+private:
+    vector<string> answer(const string& query) const
+    {
+        const auto it = answers.find(query);
+        if (it == answers.end() || it->second.empty())
+        {
+            return {};
+        }
+        const size_t commands_done = replay.commands_replayed();
+        const SystemInfoAnswer* current = &it->second.front();
+        for (const auto& recorded : it->second)
+        {
+            if (recorded.after_commands > commands_done) break;
+            current = &recorded;
+        }
+        return current->values;
+    }
+};
+
+// Compares a run against a baseline, matching steps by argv and occurrence. A step regresses when it got more
+// than threshold_percent slower (and at least 50 ms, to ignore scheduling noise) or changed its exit status;
+// the total is the wall-clock span of the run, so lost or gained concurrency shows up there as well.
+// Returns the number of regressions.
+int compare_command_traces(const vector<CommandTraceRecord>& baseline, const vector<CommandTraceRecord>& current,
+                           const double threshold_percent, ostream& out)
+{
+    constexpr chrono::milliseconds noise_floor(50);
+
+    const auto step_keys = [](const vector<CommandTraceRecord>& records)
+    {
+        map<string, int> occurrences;
+        vector<string> keys;
+        for (const auto& record : records)
+        {
+            const string command = join(record.argv, " ");
+            keys.push_back(command + " #" + to_string(++occurrences[command]));
+        }
+        return keys;
+    };
+    const auto total_span = [](const vector<CommandTraceRecord>& records)
+    {
+        chrono::microseconds first = chrono::microseconds::max(), last{};
+        for (const auto& record : records)
+        {
+            first = min(first, record.start);
+            last = max(last, record.start + record.duration);
+        }
+        return records.empty() ? chrono::microseconds{} : last - first;
+    };
+    const auto is_regression = [&](const chrono::microseconds base, const chrono::microseconds now)
+    {
+        return now - base >= noise_floor && static_cast<double>(now.count()) >
+            static_cast<double>(base.count()) * (1.0 + threshold_percent / 100.0);
+    };
+    // Keeps both ends of long commands, the target root or package list usually tells steps apart
+    const auto label = [](const string& key)
+    {
+        const string escaped = escape_trace_field(key);
+        return escaped.size() > 58 ? escaped.substr(0, 27) + "..." + escaped.substr(escaped.size() - 28) : escaped;
+    };
+    const auto ms = [](const chrono::microseconds duration)
+    {
+        return static_cast<double>(duration.count()) / 1000.0;
+    };
+
+    const vector<string> baseline_keys = step_keys(baseline);
+    const vector<string> current_keys = step_keys(current);
+    map<string, const CommandTraceRecord*> current_steps;
+    for (size_t i = 0; i < current.size(); ++i)
+    {
+        current_steps[current_keys[i]] = &current[i];
+    }
+
+    int regressions = 0;
+    out << fixed << setprecision(1) << left << setw(60) << "Step" << right << setw(12) << "base ms" << setw(12)
+        << "now ms" << setw(9) << "delta" << "\n";
+
+    for (size_t i = 0; i < baseline.size(); ++i)
+    {
+        out << left << setw(60) << label(baseline_keys[i]) << right << setw(12) << ms(baseline[i].duration);
+
+        const auto it = current_steps.find(baseline_keys[i]);
+        if (it == current_steps.end())
+        {
+            out << setw(12) << "-" << "  MISSING\n";
+            ++regressions;
+            continue;
+        }
+        const CommandTraceRecord& now = *it->second;
+        current_steps.erase(it);
+
+        const double base_ms = ms(baseline[i].duration);
+        out << setw(12) << ms(now.duration) << setw(8)
+            << (base_ms > 0 ? (ms(now.duration) - base_ms) / base_ms * 100.0 : 0.0) << "%";
+        if (now.exit_status != baseline[i].exit_status)
+        {
+            out << "  STATUS " << baseline[i].exit_status << " -> " << now.exit_status;
+            ++regressions;
+        }
+        else if (is_regression(baseline[i].duration, now.duration))
+        {
+            out << "  REGRESSION";
+            ++regressions;
+        }
+        out << "\n";
+    }
+    for (const auto& [key, record] : current_steps)
+    {
+        out << left << setw(60) << label(key) << right << setw(12) << "-" << setw(12) << ms(record->duration)
+            << "  NEW\n";
+    }
+
+    const chrono::microseconds baseline_total = total_span(baseline);
+    const chrono::microseconds current_total = total_span(current);
+    out << left << setw(60) << "Total (wall clock)" << right << setw(12) << ms(baseline_total) << setw(12)
+        << ms(current_total);
+    if (is_regression(baseline_total, current_total))
+    {
+        out << "  REGRESSION";
+        ++regressions;
+    }
+    out << "\n" << regressions << " regression(s), threshold " << threshold_percent << "%\n";
+    return regressions;
+}
+
+// Per-target result of a multi-target provisioning run
+struct TargetReport
+{
+    string root;
+    size_t steps_done = 0;
+    size_t steps_total = 0;
+    int exit_status = 0;
+    chrono::steady_clock::duration elapsed{};
+};
+
+// Applies one package selection to several root filesystems (debootstrap chroots or nspawn containers)
+// at once. Package lists are refreshed a single time on the host, the selection is downloaded into one
+// shared archive cache (resolved against every target's own dpkg status, so already cached .debs are not
+// fetched twice) and both are seeded into every target, so the concurrent per-target installs only contend
+// for their own dpkg lock.
+//
+// Assumes all targets use the same APT sources and suite as the host: the host's package lists replace the
+// lists of every target. Roots and the cache directory must be absolute paths.
+class MultiTargetProvisioner
+{
+    CommandExecutor& commandExecutor;
+    vector<string> target_roots;
+    string cache_dir;
+    bool use_nspawn;
+    mutex output_mutex;
+    chrono::steady_clock::duration shared_elapsed{};
+    size_t shared_steps_total = 0;
+    size_t shared_failed_step = 0; // 1-based, 0 = shared phase succeeded
+    vector<string> shared_failed_command;
+    int shared_failed_status = 0;
+
+public:
+    MultiTargetProvisioner(CommandExecutor& ce, vector<string> roots, string cache, const bool nspawn)
+        : commandExecutor(ce), target_roots(move(roots)), cache_dir(move(cache)), use_nspawn(nspawn)
+    {
+    }
+
+    vector<TargetReport> provision(const vector<string>& packages)
+    {
+        vector<TargetReport> reports(target_roots.size());
+        for (size_t i = 0; i < target_roots.size(); ++i)
+        {
+            reports[i].root = target_roots[i];
+        }
+        if (target_roots.empty())
+        {
+            return reports;
+        }
+
+        // Shared phase: refresh the host package lists once, then resolve and download the selection for
+        // every target in turn. The cache is shared, so each target only adds the .debs it lacks.
+        vector<vector<string>> shared_commands = {
+            {"sudo", "apt-get", "update"},
+            {"sudo", "mkdir", "-p", cache_dir + "/partial"}
+        };
+        for (const auto& root : target_roots)
+        {
+            shared_commands.push_back({
+                "sudo", "apt-get", "install", "--download-only", "-y",
+                "-o", "Dir::Cache::archives=" + cache_dir,
+                "-o", "Dir::State::status=" + root + "/var/lib/dpkg/status"
+            });
+            shared_commands.back().insert(shared_commands.back().end(), packages.begin(), packages.end());
+        }
+        // The downloads can outlast the sudo timestamp; re-validate it here so that the per-target threads
+        // do not race for the terminal with their own password prompts
+        shared_commands.push_back({"sudo", "-v"});
+        shared_steps_total = shared_commands.size();
+        const auto shared_start = chrono::steady_clock::now();
+        for (size_t i = 0; i < shared_commands.size(); ++i)
+        {
+            const vector<string>& command = shared_commands[i];
+            report_progress("shared", i + 1, shared_commands.size(), command);
+            if (const int status = commandExecutor.execute(command); status != 0)
+            {
+                shared_elapsed = chrono::steady_clock::now() - shared_start;
+                shared_failed_step = i + 1;
+                shared_failed_command = command;
+                shared_failed_status = status;
+
+                // Nothing was seeded yet, so no target can be provisioned
+                for (auto& report : reports)
+                {
+                    report.exit_status = status;
+                }
+                return reports;
+            }
+        }
+        shared_elapsed = chrono::steady_clock::now() - shared_start;
+
+        // Per-target phase, one thread per root filesystem
+        vector<thread> workers;
+        workers.reserve(target_roots.size());
+        for (size_t i = 0; i < target_roots.size(); ++i)
+        {
+            workers.emplace_back([this, &packages, &report = reports[i]] { provision_target(packages, report); });
+        }
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+        return reports;
+    }
+
+    void print_report(const vector<TargetReport>& reports, ostream& out) const
+    {
+        out << "\nProvisioning report (shared download phase: " << format_seconds(shared_elapsed) << ")\n";
+        if (shared_failed_step != 0)
+        {
+            out << "  Shared step " << shared_failed_step << "/" << shared_steps_total << " failed with exit status "
+                << shared_failed_status << ": " << join(shared_failed_command, " ") << "\n";
+        }
+        for (const auto& report : reports)
+        {
+            out << "  " << left << setw(40) << report.root << right;
+            if (shared_failed_step != 0)
+            {
+                out << " not started, shared step " << shared_failed_step << " failed\n";
+                continue;
+            }
+            out << " steps " << report.steps_done << "/" << report.steps_total
+                << "  " << setw(9) << format_seconds(report.elapsed)
+                << "  " << (report.exit_status == 0 ? "OK" : "FAILED (" + to_string(report.exit_status) + ")")
+                << "\n";
+        }
+    }
+
+private:
+    void provision_target(const vector<string>& packages, TargetReport& report)
+    {
+        const string& root = report.root;
+
+        // Root paths are passed as positional parameters so they never need shell quoting
+        vector<vector<string>> commands = {
+            {"sudo", "sh", "-c", R"(mkdir -p "$1/var/lib/apt/lists" && cp -ru /var/lib/apt/lists/. "$1/var/lib/apt/lists/")",
+             "sh", root},
+            {
+                "sudo", "sh", "-c",
+                R"(mkdir -p "$1/var/cache/apt/archives" && n=0 && for f in "$2"/*.deb; do [ -e "$f" ] || continue; )"
+                R"(cp -lu "$f" "$1/var/cache/apt/archives/" 2>/dev/null || cp -u "$f" "$1/var/cache/apt/archives/" || exit 1; )"
+                R"(n=$((n+1)); done; [ "$n" -gt 0 ] || echo "Warning: no .deb files in $2 to seed into $1" >&2)",
+                "sh", root, cache_dir
+            },
+            // All targets share one terminal, so neither debconf nor dpkg may prompt
+            enter_target(root, {
+                             "env", "DEBIAN_FRONTEND=noninteractive", "apt-get", "install", "-y",
+                             "-o", "Dpkg::Options::=--force-confold"
+                         })
+        };
+        commands.back().insert(commands.back().end(), packages.begin(), packages.end());
+
+        report.steps_total = commands.size();
+        const auto start = chrono::steady_clock::now();
+        for (const auto& command : commands)
+        {
+            report_progress(root, report.steps_done + 1, report.steps_total, command);
+            report.exit_status = commandExecutor.execute(command);
+            if (report.exit_status != 0)
+            {
+                break;
+            }
+            ++report.steps_done;
+        }
+        report.elapsed = chrono::steady_clock::now() - start;
+
+        const lock_guard lock(output_mutex);
+        cout << "[" << root << "] " << (report.exit_status == 0 ? "done" : "failed") << " after "
+            << format_seconds(report.elapsed) << "\n";
     }
-};
 
-string join(const vector<string>& vec, const string& delimiter)
-{
-    string result;
-    if (vec.empty()) result = "None";
+    vector<string> enter_target(const string& root, const vector<string>& command) const
+    {
+        vector<string> wrapped = use_nspawn
+                                     ? vector<string>{"sudo", "systemd-nspawn", "-q", "-D", root}
+                                     : vector<string>{"sudo", "chroot", root};
+        wrapped.insert(wrapped.end(), command.begin(), command.end());
+        return wrapped;
+    }
 
-    for (size_t i = 0; i < vec.size(); ++i)
+    void report_progress(const string& label, const size_t step, const size_t total, const vector<string>& command)
     {
-        if (i > 0) result += delimiter;
-        result += vec[i];
+        const lock_guard lock(output_mutex);
+        cout << "[" << label << "] step " << step << "/" << total << ": " << join(command, " ") << "\n";
     }
-    return result;
-}
+
+    static string format_seconds(const chrono::steady_clock::duration elapsed)
+    {
+        ostringstream out;
+        out << fixed << setprecision(2) << chrono::duration<double>(elapsed).count() << "s";
+        return out.str();
+    }
+};
 
 // LinuxBasix class
 class LinuxBasix
@@ -219,6 +1129,33 @@ public:
         endwin();
     }
 
+    // Runs install entries of the main menu in order without the ncurses UI, e.g. to benchmark a
+    // recorded run with ReplayCommandExecutor. Returns false on an unknown entry or a failed command.
+    bool run_batch(const vector<int>& options)
+    {
+        bool success = true;
+        for (const int option : options)
+        {
+            if (option == 2 && !config.target_roots.empty())
+            {
+                success = provision_selection() && success;
+                continue;
+            }
+
+            const vector<vector<string>> commands = commands_for_option(option);
+            if (commands.empty())
+            {
+                cerr << "Main menu entry " << option << " cannot be run without the menu\n";
+                return false;
+            }
+            for (const auto& command : commands)
+            {
+                success = commandExecutor.execute(command) == 0 && success;
+            }
+        }
+        return success;
+    }
+
 private:
     void main_menu(WINDOW* stdscr)
     {
@@ -327,11 +1264,20 @@ private:
         case 1:
             select_programs(stdscr, config.programs_to_install, selected_apt_programs, 2, "packages");
             break;
+        case 2:
+            if (!config.target_roots.empty())
+            {
+                provision_target_roots(stdscr);
+                break;
+            }
+            execute_code_block(stdscr, highlight_main);
+            break;
         case 3:
             add_custom_programs(stdscr);
             break;
         case 4:
-            select_programs(stdscr, config.flatpak_programs_to_install, selected_flatpak_programs, 4, "Flatpaks");
+            select_programs(stdscr, config.flatpak_programs_to_install, selected_flatpak_programs, 4, "Flatpaks",
+                            systemInfo.getDeployedFlatpakApps());
             break;
         case 9:
             select_programs(stdscr, systemInfo.checkPackageManagers(), selected_package_manager, 5, "package manager");
@@ -347,11 +1293,15 @@ private:
 
     void static select_programs(const WINDOW* stdscr, const vector<string>& programs_to_sort,
                                 set<string>& selected_programs,
-                                const int menu_color, const string& program_type)
+                                const int menu_color, const string& program_type,
+                                const set<string>& installed_programs = {})
     {
         vector<string> sorted_programs = programs_to_sort;
         sort(sorted_programs.begin(), sorted_programs.end());
 
+        const string installed_marker = " (installed)";
+        const int marker_width = installed_programs.empty() ? 0 : static_cast<int>(installed_marker.size());
+
         int height, width;
         getmaxyx(stdscr, height, width);
         const int win_height = min(static_cast<int>(sorted_programs.size()) + 6, height - 2);
@@ -359,7 +1309,8 @@ private:
                                                                    [](const string& a, const string& b)
                                                                    {
                                                                        return a.size() < b.size();
-                                                                   })->size()) + 10, 50), width - 2);
+                                                                   })->size()) + 10 + marker_width, 50),
+                                  width - 2);
 
         const int start_y = (height - win_height) / 2;
         const int start_x = (width - win_width) / 2;
@@ -397,7 +1348,8 @@ private:
                     wattron(win, A_REVERSE);
                 }
                 string display_str = (selected_programs.count(sorted_programs[i + start_idx]) ? "[+] " : "[ ] ") +
-                    sorted_programs[i + start_idx];
+                    sorted_programs[i + start_idx] +
+                    (installed_programs.count(sorted_programs[i + start_idx]) ? installed_marker : "");
                 mvwprintw(win, i + 3, 2, "%-*s", win_width - 4, display_str.c_str());
                 wattroff(win, A_REVERSE);
             }
@@ -444,12 +1396,9 @@ private:
         }
     }
 
-    void execute_code_block(WINDOW* stdscr, const int option)
+    // Commands run by the install entries of the main menu (2, 5, 6, 7 and 8)
+    vector<vector<string>> commands_for_option(const int option) const
     {
-        wclear(stdscr);
-        wrefresh(stdscr);
-        curs_set(2);
-
         vector<vector<string>> commands;
         if (option == 2)
         {
@@ -469,11 +1418,22 @@ private:
         }
         else if (option == 5)
         {
-            commands = {
-                {"clear"},
-                {"flatpak", "install"}
-            };
-            commands[1].insert(commands[1].end(), selected_flatpak_programs.begin(), selected_flatpak_programs.end());
+            // Already deployed apps are left out so flatpak does not resolve them against the remote again
+            const set<string> deployed = systemInfo.getDeployedFlatpakApps();
+            vector<string> to_install;
+            set_difference(selected_flatpak_programs.begin(), selected_flatpak_programs.end(),
+                           deployed.begin(), deployed.end(), back_inserter(to_install));
+
+            commands = {{"clear"}};
+            if (to_install.empty())
+            {
+                commands.push_back({"echo", "All selected Flatpaks are already installed."});
+            }
+            else
+            {
+                commands.push_back({"flatpak", "install"});
+                commands[1].insert(commands[1].end(), to_install.begin(), to_install.end());
+            }
         }
         else if (option == 6)
         {
@@ -508,6 +1468,17 @@ private:
             };
         }
 
+        return commands;
+    }
+
+    void execute_code_block(WINDOW* stdscr, const int option)
+    {
+        wclear(stdscr);
+        wrefresh(stdscr);
+        curs_set(2);
+
+        const vector<vector<string>> commands = commands_for_option(option);
+
         endwin();
         for (const auto& command : commands)
         {
@@ -522,6 +1493,35 @@ private:
         keypad(stdscr, TRUE);
     }
 
+    bool provision_selection()
+    {
+        vector<string> packages(selected_apt_programs.begin(), selected_apt_programs.end());
+        packages.insert(packages.end(), user_added_programs.begin(), user_added_programs.end());
+
+        MultiTargetProvisioner provisioner(commandExecutor, config.target_roots, config.shared_cache_dir,
+                                           config.use_nspawn);
+        const vector<TargetReport> reports = provisioner.provision(packages);
+        provisioner.print_report(reports, cout);
+        return all_of(reports.begin(), reports.end(), [](const TargetReport& r) { return r.exit_status == 0; });
+    }
+
+    void provision_target_roots(WINDOW* stdscr)
+    {
+        wclear(stdscr);
+        wrefresh(stdscr);
+        endwin();
+
+        provision_selection();
+
+        cout << "Press any key to return to the main menu...";
+        cin.get();
+        initscr();
+        cbreak();
+        noecho();
+        curs_set(0);
+        keypad(stdscr, TRUE);
+    }
+
     void append_to_bashrc_and_edit() const
     {
         const char* home = getenv("HOME");
@@ -641,6 +1641,8 @@ void LinuxBasix::display_main_menu(WINDOW* stdscr, const int highlight) const
     const string kernel = "Current Linux Kernel version: " + string(kernelVersion);
     const string packetmanagers = "Detected packet managers (* = selected): " + join(availablePackageManagers, " | ");
     const string customprograms = "Manually added repo packages: " + join(user_added_programs, " | ");
+    const string targetroots = "Target root filesystems" + string(config.use_nspawn ? " (nspawn)" : "") + ": " +
+        join(config.target_roots, " | ");
 
     // mvwprintw(stdscr, height - 2, 2, "%s", packer_text.c_str());
     mvwprintw(stdscr, height - 3, 2, "%s", version_info.c_str());
@@ -649,13 +1651,455 @@ void LinuxBasix::display_main_menu(WINDOW* stdscr, const int highlight) const
     mvwprintw(stdscr, height - 6, 2, "%s", kernel.c_str());
     mvwprintw(stdscr, height - 7, 2, "%s", packetmanagers.c_str());
     mvwprintw(stdscr, height - 8, 2, "%s", customprograms.c_str());
+    mvwprintw(stdscr, height - 9, 2, "%s", targetroots.c_str());
 
     attroff(A_BOLD);
 }
 
-int main() // int argc, char* argv[] -- for future cli options, not implemented yet
+// Prints the deployed flatpak apps found by FlatpakInstallationReader and compares its run time with `flatpak list`
+int compare_flatpak_state_timing(CommandExecutor& commandExecutor)
+{
+    const vector<string> dirs = RealSystemInfo::flatpakInstallationDirs();
+
+    const auto reader_start = chrono::steady_clock::now();
+    const vector<FlatpakRef> refs = FlatpakInstallationReader(dirs).readDeployedApps();
+    const chrono::duration<double, milli> reader_elapsed = chrono::steady_clock::now() - reader_start;
+
+    for (const auto& ref : refs)
+    {
+        cout << ref.app_id << "\t" << ref.arch << "\t" << ref.branch << "\t" << ref.installation << "\n";
+    }
+
+    cout << "\n--- flatpak list ---\n" << flush;
+    const auto list_start = chrono::steady_clock::now();
+    const int status = commandExecutor.execute({"flatpak", "list", "--app", "--columns=application,arch,branch"});
+    const chrono::duration<double, milli> list_elapsed = chrono::steady_clock::now() - list_start;
+
+    cout << fixed << setprecision(2)
+        << "\nInstallation reader: " << refs.size() << " refs in " << reader_elapsed.count() << " ms (" << join(dirs, ", ")
+        << ")\n"
+        << "flatpak list:        " << list_elapsed.count() << " ms"
+        << (status == 0 ? "" : " (exit status " + to_string(status) + ")") << "\n";
+    return status == 0 ? 0 : 1;
+}
+
+// apt resolves relative Dir:: values below its own directories, so paths handed to it must be absolute
+string absolute_path(const char* path)
+{
+    error_code ec;
+    const filesystem::path absolute = filesystem::absolute(path, ec);
+    return ec ? string(path) : absolute.lexically_normal().string();
+}
+
+// --self-test: checks that run locally against fixture directories and mock executors, no root needed
+class SelfTest
+{
+    int failures = 0;
+
+public:
+    void check(const bool ok, const string& what)
+    {
+        cout << (ok ? "  ok    " : "  FAIL  ") << what << "\n";
+        failures += ok ? 0 : 1;
+    }
+
+    int failed() const
+    {
+        return failures;
+    }
+
+    // Creates a fresh directory below $TMPDIR (or /tmp), removed again by remove_fixture_dir(). On failure
+    // the check fails and the caller must return: an empty fixture path would put the fixtures below "/".
+    bool make_fixture_dir(string& dir)
+    {
+        const char* tmp = getenv("TMPDIR");
+        string pattern = string(tmp ? tmp : "/tmp") + "/linuxbasix-selftest-XXXXXX";
+        const bool created = mkdtemp(pattern.data()) != nullptr;
+        dir = created ? pattern : string();
+        check(created, "fixture directory created in " + string(tmp ? tmp : "/tmp"));
+        return created;
+    }
+
+    static void remove_fixture_dir(const string& dir)
+    {
+        error_code ec;
+        filesystem::remove_all(dir, ec);
+    }
+};
+
+// Records every command together with the thread that ran it; fails commands containing fail_marker.
+// Commands containing barrier_marker are held until barrier_count of them are running at the same time
+// (or a timeout passes), which only works out if they really run concurrently.
+class MockCommandExecutor final : public CommandExecutor
+{
+    mutex calls_mutex;
+    condition_variable barrier_cv;
+    string fail_marker;
+    string barrier_marker;
+    size_t barrier_count;
+    size_t barrier_arrived = 0;
+
+public:
+    vector<pair<thread::id, vector<string>>> calls;
+    bool barrier_released = false;
+    bool barrier_timed_out = false;
+
+    explicit MockCommandExecutor(string marker = {}, string barrier = {}, const size_t count = 0)
+        : fail_marker(move(marker)), barrier_marker(move(barrier)), barrier_count(count)
+    {
+    }
+
+    int execute(const vector<string>& command) override
+    {
+        unique_lock lock(calls_mutex);
+        calls.emplace_back(this_thread::get_id(), command);
+        if (!barrier_marker.empty() && find(command.begin(), command.end(), barrier_marker) != command.end())
+        {
+            if (++barrier_arrived == barrier_count)
+            {
+                barrier_released = true;
+                barrier_cv.notify_all();
+            }
+            if (!barrier_cv.wait_for(lock, chrono::seconds(5), [this] { return barrier_released; }))
+            {
+                barrier_timed_out = true;
+            }
+        }
+        const bool fail = !fail_marker.empty() && find(command.begin(), command.end(), fail_marker) != command.end();
+        return fail ? 1 : 0;
+    }
+
+    // Calls whose argv contains all of the given arguments
+    vector<pair<thread::id, vector<string>>> calls_with(const vector<string>& args) const
+    {
+        vector<pair<thread::id, vector<string>>> matching;
+        for (const auto& call : calls)
+        {
+            if (all_of(args.begin(), args.end(), [&call](const string& arg)
+            {
+                return find(call.second.begin(), call.second.end(), arg) != call.second.end();
+            }))
+            {
+                matching.push_back(call);
+            }
+        }
+        return matching;
+    }
+};
+
+void self_test_multi_target(SelfTest& test)
+{
+    cout << "MultiTargetProvisioner\n";
+    string fixture;
+    if (!test.make_fixture_dir(fixture))
+    {
+        return;
+    }
+
+    // debootstrap-style roots: just enough of a Debian tree for the paths the provisioner hands to apt
+    vector<string> roots;
+    for (const char* name : {"desktop", "laptop", "server"})
+    {
+        const string root = fixture + "/" + name;
+        error_code ec;
+        filesystem::create_directories(root + "/var/lib/dpkg", ec);
+        filesystem::create_directories(root + "/etc/apt", ec);
+        ofstream(root + "/var/lib/dpkg/status") << "Package: base-files\nStatus: install ok installed\n";
+        ofstream(root + "/etc/apt/sources.list") << "deb http://deb.debian.org/debian bookworm main\n";
+        roots.push_back(root);
+    }
+    const string cache = fixture + "/cache";
+
+    MockCommandExecutor executor({}, "chroot", roots.size());
+    MultiTargetProvisioner provisioner(executor, roots, cache, false);
+    const vector<TargetReport> reports = provisioner.provision({"htop", "mc"});
+    const thread::id main_thread = this_thread::get_id();
+    test.check(executor.barrier_released && !executor.barrier_timed_out, "all targets reach their install step at the same time");
+
+    const auto updates = executor.calls_with({"apt-get", "update"});
+    test.check(updates.size() == 1 && updates[0].first == main_thread, "apt-get update runs once, before fan-out");
+    test.check(executor.calls_with({"mkdir", "-p", cache + "/partial"}).size() == 1, "shared cache prepared once");
+    test.check(executor.calls_with({"--download-only"}).size() == roots.size(),
+               "selection downloaded once per target into the shared cache");
+    const auto validations = executor.calls_with({"sudo", "-v"});
+    test.check(validations.size() == 1 && validations[0].first == main_thread &&
+               executor.calls[roots.size() + 2].second == validations[0].second,
+               "sudo credentials refreshed once, after the downloads and before fan-out");
+    test.check(executor.calls_with({"DEBIAN_FRONTEND=noninteractive", "Dpkg::Options::=--force-confold"}).size() ==
+               roots.size(), "targets install non-interactively");
+
+    for (size_t i = 0; i < roots.size(); ++i)
+    {
+        const string& root = roots[i];
+        const auto downloads = executor.calls_with({"--download-only", "Dir::State::status=" + root + "/var/lib/dpkg/status"});
+        const auto seeds = executor.calls_with({"sh", root});
+        const auto seed_debs = executor.calls_with({"sh", root, cache});
+        const auto installs = executor.calls_with({"chroot", root, "install", "htop", "mc"});
+        test.check(downloads.size() == 1 && downloads[0].first == main_thread,
+                   root + ": resolved against its own dpkg status");
+        test.check(seeds.size() == 2 && seed_debs.size() == 1 && installs.size() == 1,
+                   root + ": own seed and install commands");
+        test.check(installs.size() == 1 && installs[0].first != main_thread && seed_debs.size() == 1 &&
+                   seed_debs[0].first == installs[0].first, root + ": provisioned on its own thread");
+        test.check(reports[i].exit_status == 0 && reports[i].steps_done == 3, root + ": reported as done");
+    }
+
+    // Run the real archive seeding script (without sudo) against the first fixture root
+    vector<string> seed_command = executor.calls_with({"sh", roots[0], cache}).front().second;
+    seed_command.erase(seed_command.begin());
+    RealCommandExecutor shell;
+    {
+        error_code ec;
+        filesystem::create_directories(cache, ec);
+    }
+    ofstream(cache + "/htop_3.2.2-2_amd64.deb") << "fixture";
+    test.check(shell.execute(seed_command) == 0 &&
+               filesystem::exists(roots[0] + "/var/cache/apt/archives/htop_3.2.2-2_amd64.deb"),
+               "seed step copies cached .debs into the target");
+    test.check(filesystem::path(absolute_path("img/a")).is_absolute(), "relative roots are made absolute");
+
+    MockCommandExecutor failing("update");
+    MultiTargetProvisioner failing_provisioner(failing, roots, cache, false);
+    const vector<TargetReport> failed_reports = failing_provisioner.provision({"htop"});
+    test.check(all_of(failed_reports.begin(), failed_reports.end(), [](const TargetReport& r)
+    {
+        return r.exit_status != 0 && r.steps_done == 0;
+    }), "failed shared step marks every target as failed");
+    test.check(failing.calls_with({"chroot"}).empty(), "no target is entered after a failed shared step");
+    ostringstream failed_report;
+    failing_provisioner.print_report(failed_reports, failed_report);
+    test.check(failed_report.str().find("Shared step 1/6 failed with exit status 1: sudo apt-get update") !=
+               string::npos, "report names the failed shared step");
+
+    SelfTest::remove_fixture_dir(fixture);
+}
+
+void self_test_flatpak_reader(SelfTest& test)
+{
+    cout << "FlatpakInstallationReader\n";
+    string fixture;
+    if (!test.make_fixture_dir(fixture))
+    {
+        return;
+    }
+    const string system_dir = fixture + "/system";
+    const string user_dir = fixture + "/user";
+
+    utsname buffer{};
+    uname(&buffer);
+    const string native = FlatpakInstallationReader::flatpakArch(buffer.machine);
+    const string foreign = native == "aarch64" ? "x86_64" : "aarch64";
+
+    // app/<id>/<arch>/<branch>/<commit> with "active" pointing at the deployed commit
+    const auto deploy = [](const string& installation, const string& app, const string& arch, const bool active)
+    {
+        const string branch = installation + "/app/" + app + "/" + arch + "/stable";
+        error_code ec;
+        filesystem::create_directories(branch + "/0123abcd", ec);
+        if (active)
+        {
+            filesystem::create_directory_symlink("0123abcd", branch + "/active", ec);
+        }
+    };
+    deploy(system_dir, "org.gimp.GIMP", native, true);
+    deploy(system_dir, "org.gnome.Boxes", foreign, true);
+    deploy(system_dir, "net.sf.VICE", native, false);
+    deploy(user_dir, "com.spotify.Client", native, true);
+    {
+        error_code ec;
+        filesystem::create_directory_symlink(native + "/stable", system_dir + "/app/org.gimp.GIMP/current", ec);
+    }
+
+    const vector<FlatpakRef> refs = FlatpakInstallationReader({system_dir, user_dir}).readDeployedApps();
+    const auto has_ref = [&refs](const string& app, const string& arch, const string& installation)
+    {
+        return any_of(refs.begin(), refs.end(), [&](const FlatpakRef& ref)
+        {
+            return ref.app_id == app && ref.arch == arch && ref.branch == "stable" && ref.installation == installation;
+        });
+    };
+    test.check(has_ref("org.gimp.GIMP", native, system_dir), "deployed app/<id>/<arch>/<branch>/active is found");
+    test.check(none_of(refs.begin(), refs.end(), [](const FlatpakRef& ref) { return ref.arch == "current"; }),
+               "\"current\" symlink is skipped");
+    test.check(none_of(refs.begin(), refs.end(), [](const FlatpakRef& ref) { return ref.app_id == "net.sf.VICE"; }),
+               "branch without \"active\" is ignored");
+    test.check(has_ref("com.spotify.Client", native, user_dir), "user installation is read");
+    test.check(refs.size() == 3, "exactly the three deployed refs are listed");
+    test.check(FlatpakInstallationReader({fixture + "/missing"}).readDeployedApps().empty(),
+               "missing installation directory yields no refs");
+
+    setenv("FLATPAK_SYSTEM_DIR", system_dir.c_str(), 1);
+    setenv("FLATPAK_USER_DIR", user_dir.c_str(), 1);
+    const set<string> deployed = RealSystemInfo().getDeployedFlatpakApps();
+    test.check(deployed == set<string>{"com.spotify.Client", "org.gimp.GIMP"},
+               "getDeployedFlatpakApps filters out the foreign arch");
+
+    SelfTest::remove_fixture_dir(fixture);
+}
+
+void self_test_record_replay(SelfTest& test)
 {
+    cout << "Record/replay (--run 5)\n";
+    string fixture;
+    if (!test.make_fixture_dir(fixture))
+    {
+        return;
+    }
+    const string bin_dir = fixture + "/bin";
+    const string system_dir = fixture + "/system";
+    const string user_dir = fixture + "/user";
+    {
+        error_code ec;
+        filesystem::create_directories(bin_dir, ec);
+        filesystem::create_directories(system_dir, ec);
+        filesystem::create_directories(user_dir, ec);
+    }
+
+    utsname buffer{};
+    uname(&buffer);
+    const string native = FlatpakInstallationReader::flatpakArch(buffer.machine);
+
+    // Stand-ins on PATH: `flatpak install` deploys into the fixture installation, so the recorded run changes
+    // the state that option 5 is built from, and `clear` must not wipe the terminal
+    ofstream(bin_dir + "/flatpak") << "#!/bin/sh\n[ \"$1\" = install ] || exit 1; shift\n"
+        << "for app in \"$@\"; do d=\"$FLATPAK_SYSTEM_DIR/app/$app/" << native << "/stable\"; "
+        << "mkdir -p \"$d/0123abcd\" && ln -sfn 0123abcd \"$d/active\" && echo \"Installed $app\"; done\n";
+    ofstream(bin_dir + "/clear") << "#!/bin/sh\n";
+    for (const char* tool : {"/flatpak", "/clear"})
+    {
+        error_code ec;
+        filesystem::permissions(bin_dir + tool, filesystem::perms::owner_all, ec);
+    }
+    const char* old_path = getenv("PATH");
+    const string saved_path = old_path ? old_path : "";
+    setenv("PATH", (bin_dir + ":" + saved_path).c_str(), 1);
+    setenv("FLATPAK_SYSTEM_DIR", system_dir.c_str(), 1);
+    setenv("FLATPAK_USER_DIR", user_dir.c_str(), 1);
+
     const Configuration config = {
+        {"Select Flatpak packages", "Install Flatpak packages", "Exit"},
+        {},
+        {"org.gimp.GIMP", "org.videolan.VLC"},
+        {},
+        "",
+        false
+    };
+    RealFileSystem fileSystem;
+    const string recorded_path = fixture + "/recorded.trace";
+    const string replayed_path = fixture + "/replayed.trace";
+
+    bool recorded_ok;
+    {
+        CommandTraceWriter trace(recorded_path);
+        RealSystemInfo realSystemInfo;
+        RecordingSystemInfo systemInfo(realSystemInfo, trace);
+        RecordingCommandExecutor executor(trace);
+
+        // Like the interactive menu: redraws and the Flatpak picker query before anything is installed
+        for (int redraw = 0; redraw < 3; ++redraw)
+        {
+            systemInfo.getKernelVersion();
+            systemInfo.checkPackageManagers();
+        }
+        systemInfo.getDeployedFlatpakApps();
+        recorded_ok = LinuxBasix(config, systemInfo, fileSystem, executor).run_batch({5});
+        systemInfo.getDeployedFlatpakApps(); // picker opened again after the install
+    }
+    test.check(recorded_ok, "recorded run succeeds");
+    test.check(RealSystemInfo().getDeployedFlatpakApps().size() == 2, "recorded run deployed both Flatpaks");
+
+    CommandTrace recorded;
+    test.check(read_command_trace(recorded_path, recorded), "recorded trace can be read back");
+    test.check(recorded.system_info["kernel_version"].size() == 1 &&
+               recorded.system_info["package_managers"].size() == 1,
+               "repeated identical answers (menu redraws) are recorded once");
+    const vector<SystemInfoAnswer>& deployed_answers = recorded.system_info["deployed_flatpak_apps"];
+    test.check(deployed_answers.size() == 2 && deployed_answers[0].after_commands == 0 &&
+               deployed_answers[0].values.empty() && deployed_answers[1].after_commands == recorded.commands.size() &&
+               deployed_answers[1].values.size() == 2,
+               "deployed Flatpaks are recorded with the command progress they changed at");
+
+    bool replayed_ok;
+    {
+        CommandTraceWriter trace(replayed_path);
+        ReplayCommandExecutor executor(recorded.commands, 0.0, &trace);
+        ReplaySystemInfo replaySystemInfo(recorded.system_info, executor);
+        RecordingSystemInfo systemInfo(replaySystemInfo, trace);
+
+        // A different number of redraws and picker openings than in the recorded run
+        for (int redraw = 0; redraw < 7; ++redraw)
+        {
+            systemInfo.getKernelVersion();
+            systemInfo.getDeployedFlatpakApps();
+        }
+        replayed_ok = LinuxBasix(config, systemInfo, fileSystem, executor).run_batch({5});
+        test.check(replaySystemInfo.getDeployedFlatpakApps().size() == 2,
+                   "replayed answers follow the recorded state changes");
+    }
+    CommandTrace replayed;
+    test.check(read_command_trace(replayed_path, replayed), "replayed trace can be read back");
+    test.check(replayed_ok, "replay succeeds although the Flatpaks are deployed now");
+
+    const auto argvs = [](const CommandTrace& trace)
+    {
+        vector<vector<string>> commands;
+        for (const auto& record : trace.commands) commands.push_back(record.argv);
+        return commands;
+    };
+    test.check(!recorded.commands.empty() && argvs(recorded) == argvs(replayed),
+               "replay issues the recorded commands, including flatpak install");
+    ostringstream report;
+    test.check(compare_command_traces(recorded.commands, replayed.commands, 100.0, report) == 0,
+               "compare finds no missing steps or status changes");
+
+    setenv("PATH", saved_path.c_str(), 1);
+    SelfTest::remove_fixture_dir(fixture);
+}
+
+int run_self_tests()
+{
+    SelfTest test;
+    self_test_multi_target(test);
+    self_test_flatpak_reader(test);
+    self_test_record_replay(test);
+    cout << (test.failed() == 0 ? "All self tests passed\n" : to_string(test.failed()) + " self test(s) failed\n");
+    return test.failed() == 0 ? 0 : 1;
+}
+
+void print_usage(const char* program)
+{
+    cout << "Usage: " << program << " [--target DIR]... [--cache DIR] [--nspawn] [--flatpak-state]\n"
+        << "       [--run N]... [--record FILE] [--replay FILE [--replay-scale X]]\n"
+        << "       " << program << " --compare BASELINE CURRENT [--threshold PERCENT]\n"
+        << "  --target DIR  install the repo package selection into root filesystem DIR (repeatable,\n"
+        << "                all targets are provisioned concurrently)\n"
+        << "  --cache DIR   .deb cache shared by all targets (default: /var/cache/linuxbasix/archives)\n"
+        << "  --nspawn      enter targets with systemd-nspawn instead of chroot\n"
+        << "  --flatpak-state  list deployed flatpak apps and compare the lookup time with `flatpak list`\n"
+        << "  --run N       run main menu entry N (2, 5, 6, 7 or 8) without the menu (repeatable)\n"
+        << "  --record FILE write argv, output, exit status and timing of every command to trace FILE\n"
+        << "  --replay FILE play back trace FILE instead of running commands\n"
+        << "  --replay-scale X  multiply replayed delays by X (default 1 = exact, 0 = no delays)\n"
+        << "  --compare BASELINE CURRENT  compare two traces, exit status 1 on regressions\n"
+        << "  --threshold PERCENT  slowdown counted as regression (default 10)\n"
+        << "  --self-test   run the built-in checks against fixture directories and mock executors\n";
+}
+
+bool parse_non_negative(const char* text, double& value)
+{
+    char* end = nullptr;
+    const double parsed = strtod(text, &end);
+    if (end == text || *end != '\0' || parsed < 0)
+    {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+int main(const int argc, char* argv[])
+{
+    Configuration config = {
         // main_menu_options
         {
             "Select original repo packages",
@@ -686,14 +2130,150 @@ int main() // int argc, char* argv[] -- for future cli options, not implemented
             "org.DolphinEmu.dolphin-emu", "org.duckstation.DuckStation", "org.libretro.RetroArch",
             "org.mozilla.Thunderbird", "net.sf.VICE", "net.fsuae.FS-UAE", "org.audacityteam.Audacity",
             "org.gimp.GIMP", "org.gnome.Boxes", "com.transmissionbt.Transmission", "fr.handbrake.ghb"
-        }
+        },
+        // target_roots
+        {},
+        // shared_cache_dir
+        "/var/cache/linuxbasix/archives",
+        // use_nspawn
+        false
     };
 
-    RealSystemInfo systemInfo;
+    bool show_flatpak_state = false;
+    vector<int> batch_options;
+    string record_path, replay_path, compare_baseline, compare_current;
+    double replay_scale = 1.0;
+    double regression_threshold = 10.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const string arg = argv[i];
+        if (arg == "--target" && i + 1 < argc)
+        {
+            config.target_roots.push_back(absolute_path(argv[++i]));
+        }
+        else if (arg == "--cache" && i + 1 < argc)
+        {
+            config.shared_cache_dir = absolute_path(argv[++i]);
+        }
+        else if (arg == "--nspawn")
+        {
+            config.use_nspawn = true;
+        }
+        else if (arg == "--flatpak-state")
+        {
+            show_flatpak_state = true;
+        }
+        else if (arg == "--run" && i + 1 < argc)
+        {
+            batch_options.push_back(atoi(argv[++i])); // invalid entries are rejected by run_batch()
+        }
+        else if (arg == "--record" && i + 1 < argc)
+        {
+            record_path = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            replay_path = argv[++i];
+        }
+        else if (arg == "--replay-scale" && i + 1 < argc && parse_non_negative(argv[i + 1], replay_scale))
+        {
+            ++i;
+        }
+        else if (arg == "--compare" && i + 2 < argc)
+        {
+            compare_baseline = argv[++i];
+            compare_current = argv[++i];
+        }
+        else if (arg == "--threshold" && i + 1 < argc && parse_non_negative(argv[i + 1], regression_threshold))
+        {
+            ++i;
+        }
+        else if (arg == "--self-test")
+        {
+            return run_self_tests();
+        }
+        else if (arg == "-h" || arg == "--help")
+        {
+            print_usage(argv[0]);
+            return 0;
+        }
+        else
+        {
+            cerr << "Unknown or incomplete option: " << arg << "\n";
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!compare_baseline.empty())
+    {
+        CommandTrace baseline, current;
+        if (!read_command_trace(compare_baseline, baseline) || !read_command_trace(compare_current, current))
+        {
+            cerr << "Unable to read command traces " << compare_baseline << " and " << compare_current << "\n";
+            return 1;
+        }
+        return compare_command_traces(baseline.commands, current.commands, regression_threshold, cout) == 0 ? 0 : 1;
+    }
+
+    unique_ptr<CommandTraceWriter> trace;
+    if (!record_path.empty())
+    {
+        trace = make_unique<CommandTraceWriter>(record_path);
+        if (!trace->is_open())
+        {
+            cerr << "Unable to open " << record_path << " for recording\n";
+            return 1;
+        }
+    }
+
+    // A replay takes its SystemInfo answers from the trace as well, so it builds the same commands as the
+    // recorded run no matter what is installed on this machine
+    unique_ptr<SystemInfo> systemInfo;
+    unique_ptr<CommandExecutor> commandExecutor;
+    if (!replay_path.empty())
+    {
+        CommandTrace replayed;
+        if (!read_command_trace(replay_path, replayed))
+        {
+            cerr << "Unable to read command trace " << replay_path << "\n";
+            return 1;
+        }
+        auto replayExecutor = make_unique<ReplayCommandExecutor>(replayed.commands, replay_scale, trace.get());
+        systemInfo = make_unique<ReplaySystemInfo>(move(replayed.system_info), *replayExecutor);
+        commandExecutor = move(replayExecutor);
+    }
+    else if (trace)
+    {
+        commandExecutor = make_unique<RecordingCommandExecutor>(*trace);
+    }
+    else
+    {
+        commandExecutor = make_unique<RealCommandExecutor>();
+    }
+    if (!systemInfo)
+    {
+        systemInfo = make_unique<RealSystemInfo>();
+    }
+    unique_ptr<SystemInfo> recordingSystemInfo;
+    if (trace)
+    {
+        recordingSystemInfo = make_unique<RecordingSystemInfo>(*systemInfo, *trace);
+    }
+
+    if (show_flatpak_state)
+    {
+        return compare_flatpak_state_timing(*commandExecutor);
+    }
+
     RealFileSystem fileSystem;
-    RealCommandExecutor commandExecutor;
 
-    LinuxBasix app(config, systemInfo, fileSystem, commandExecutor);
+    LinuxBasix app(config, recordingSystemInfo ? *recordingSystemInfo : *systemInfo, fileSystem, *commandExecutor);
+    if (!batch_options.empty())
+    {
+        return app.run_batch(batch_options) ? 0 : 1;
+    }
     app.run();
 
     return 0;